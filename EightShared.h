@@ -2,8 +2,11 @@
 #define __EightShared_h_
 
 #include <string>
+#include <vector>
+#include <array>
 
 #include "RansHelper.h"
+#include "JumpBackSummary.h"
 #include "RansBlockReader.h"
 #include "RansBlockWriter.h"
 
@@ -14,11 +17,11 @@
 // Don't actually try to encode, compress, or store this data!
 extern const std::string preloadContents;
 
-// This should be tunable.  And probably we need to record the value in
-// to file so the reader will be able to run the identical algorithm.
-// I'm using 8,000 bytes right now because that's the default buffer size
-// that gzip uses.  (I'm not saying that's the right answer.  Just changing
-// fewer things at a time.)
+// This is the default.  EightParameters can pick a different size, and the
+// compressor records that in the file so the reader will be able to run the
+// identical algorithm.  I'm using 8,000 bytes by default because that's the
+// default buffer size that gzip uses.  (I'm not saying that's the right
+// answer.  Just changing fewer things at a time.)
 //
 // Note:  At one time we looked back this far plus 8 bytes.  That's
 // unnecessarily complicated.
@@ -27,16 +30,165 @@ extern const std::string preloadContents;
 // file and the preLoadContents) you can release the stuff at the beginning.
 extern const int maxBufferSize;
 
+// The compression level, as the algorithm sees it.  eight -1 through eight -9
+// pick one of these.  Lower levels are faster.  Higher levels look at more
+// history.  The compressor writes these values at the beginning of the file,
+// and the decompressor reads them before it does anything else.
+//
+// A bigger window is not free.  HistoryIndex::getCounts() finds the
+// previous bytes with the same 2 byte context, then it looks at every one of
+// them to see how much more context they share.  Or, if that chain is dense,
+// it scans the whole window.  Either way the time per byte grows with the
+// window.  On text, -7 (64K window) is about 3× slower than -4 (8K), and -9
+// (1M) is about 6× slower.  It gets worse on bigger, more repetitive input.
+// Levels 5 and up trade speed for compression.  They do not give you a big
+// window at a constant cost.  Use -s to split a big file across threads.
+//
+// The header is 3 words:  HEADER_MAGIC, windowSize, skipMode.  Files from
+// before we had a header start with the size of the first rANS block, which
+// is never anywhere near HEADER_MAGIC.  Those files always used
+// maxBufferSize and JumpBackSummary::STANDARD.
+//
+// A segmented file sets SEGMENTED_FLAG in the skipMode word and adds a 4th
+// word, segmentMegabytes.  That way the reader knows what to expect before
+// it looks at the end of the file.  A file that was cut short at a segment
+// boundary, or lost its segment table, is an error, not a shorter file.
+struct EightParameters
+{
+  int windowSize;
+  JumpBackSummary::Mode skipMode;
+  // 0 means an ordinary file, not segmented.  Otherwise no segment holds
+  // more than this many MB of the original file.  See EightSegment.
+  uint32_t segmentMegabytes;
+
+  // The biggest window that any level uses.  The reader rejects anything
+  // bigger, so a corrupt header can't make it allocate gigabytes.
+  static const int MAX_WINDOW_SIZE = 1<<20;
+  // Each thread holds an entire segment in memory, twice.  Eight -s won't
+  // go past this and the reader rejects anything bigger.
+  static const uint32_t MAX_SEGMENT_MEGABYTES = 1024;
+
+  bool segmented() const { return segmentMegabytes; }
+  uint64_t maxSegmentSize() const { return (uint64_t)segmentMegabytes << 20; }
+
+  static const int MIN_LEVEL = 1;
+  static const int MAX_LEVEL = 9;
+  // The same as before we had levels.
+  static const int DEFAULT_LEVEL = 4;
+  static EightParameters fromLevel(int level);
+
+  static const uint32_t HEADER_MAGIC = 0x3848dc8e;
+  static const size_t HEADER_SIZE = 12;
+  static const size_t SEGMENTED_HEADER_SIZE = 16;
+  static const uint32_t SEGMENTED_FLAG = 0x100;
+  void writeHeader(std::ostream &out) const;
+  // Returns the number of bytes in the header, possibly 0 for an older file.
+  // Throws an exception if there's a problem.
+  size_t readHeader(char const *fileName);
+  // The same, but for a pipe.  We can't go back, so we return the bytes that
+  // we read.  Give those to RansBlockReader if they weren't a header.  A
+  // segmented file needs a file name, so that's an exception.
+  size_t readHeader(int fd, std::string &alreadyRead);
+private:
+  size_t parseHeader(char const *begin, size_t size);
+};
+
+
+
+// For each possible context length (0 - 8) and each possible byte, how many
+// times did we see that byte after that much matching context?
+typedef uint32_t ByteVsContextLengthToByteCount[9][256];
+
+// HistorySummary originally walked back through the entire window for every
+// byte that we encoded or decoded.  That's O(file size * window size).  This
+// class remembers the window as it slides forward, one byte at a time, so we
+// only have to look at the interesting parts of it.
+//
+// Most positions in the window share 0 or 1 bytes of context with the byte
+// we are about to encode.  Those don't need to be examined individually.  As
+// each byte enters or leaves the window we update two histograms:  one
+// counting every byte in the window, and one counting every byte by the byte
+// that came right before it.  Together those give us the 0 and 1 byte
+// matches directly.
+//
+// We keep a hash chain for each possible pair of bytes.  Each chain lists the
+// positions in the window which come right after that pair.  Only the
+// positions on the current chain can match 2 or more bytes of context, so
+// those are the only ones we look at one at a time.  We subtract them from
+// the histograms.
+//
+// The results are identical to the brute force version of HistorySummary,
+// including the positions that JumpBackSummary tells us to skip.
+//
+// A position is a byte that can be used as history.  Position 0 is the first
+// byte after preloadContents, i.e. the first byte of the actual file.
+class HistoryIndex
+{
+private:
+  const int _windowSize;
+  const JumpBackSummary::Mode _skipMode;
+  int64_t _count;
+  // The most recent position on each chain, or -1.  Indexed by pairKey().
+  std::vector< int64_t > _head;
+  // Indexed by position % _windowSize.  The previous position on the same
+  // chain, or -1.
+  std::vector< int64_t > _previous;
+  // How many times does each byte appear in the window?
+  uint32_t _byteCounts[256];
+  // _afterByteCounts[a][b] is the number of times b appears right after a
+  // in the window.
+  std::vector< std::array< uint32_t, 256 > > _afterByteCounts;
+  // How many positions are on each chain?  Indexed by pairKey().
+  std::vector< uint32_t > _chainLength;
+  // If more than 1 / DENSE_CHAIN of the window is on the chain we need, skip
+  // the chain and scan the entire window instead.
+  static const int DENSE_CHAIN = 4;
 
+  // The two bytes right before position.
+  static int pairKey(char const *position)
+  { return (unsigned char)position[-1] | ((unsigned char)position[-2] << 8); }
+
+public:
+  HistoryIndex(int windowSize = maxBufferSize,
+	       JumpBackSummary::Mode skipMode = JumpBackSummary::STANDARD);
+  HistoryIndex(EightParameters const &parameters) :
+    HistoryIndex(parameters.windowSize, parameters.skipMode) { }
+  HistoryIndex(const HistoryIndex&) =delete;
+  void operator=(const HistoryIndex&) =delete;
+
+  // Call this once for each byte, in order, starting with the first byte of
+  // the file, after you have encoded or decoded that byte.  The 8 bytes
+  // before position and the windowSize + 2 bytes before position must still
+  // be available.
+  void add(char const *position);
+
+  // How many positions have been added so far.  end, below, must point to
+  // the byte at this position, i.e. right after the last byte added.
+  int64_t count() const { return _count; }
+
+  // Same as HistorySummary's constructor, but with the results not weighted
+  // yet.  Returns false if there is no history at all.
+  bool getCounts(char const *end, ByteVsContextLengthToByteCount &result) const;
+};
 
 class HistorySummary
 {
 private:
-  uint32_t _frequencies[256];
+  // The bytes that appeared anywhere in the window, in order.
+  int _symbolCount;
+  uint8_t _symbols[256];
+  // _slot[byte] is that byte's index in _symbols, or -1.
+  int16_t _slot[256];
+  // _start[i] is the total frequency of every symbol before _symbols[i].
+  // _start[_symbolCount] is the denominator.
+  uint32_t _start[257];
   uint32_t _denominator;
 
   static int matchingByteCount(int64_t a, int64_t b);
   static int64_t getContext(char const *ptr);
+  friend class HistoryIndex;
+
+  void load(ByteVsContextLengthToByteCount const &byteVsContextLengthToByteCount);
   
 public:
   // end is the byte that you are about to encode / decode.  We do not look
@@ -47,8 +199,15 @@ public:
   // preloadContents to the beginning of the file.  If you still don't have
   // enough data, point to the first byte you have, i.e. the first byte of
   // your copy of preloadContents.
+  //
+  // This is the brute force version.  It's slow, but it's simple and it's
+  // the reference for HistoryIndex.
   HistorySummary(char const *begin, char const *end);
 
+  // Same result as above, but much faster.  end must be the position right
+  // after the last byte that was added to index.
+  HistorySummary(HistoryIndex const &index, char const *end);
+
   // The encoder will build a HistorySummary then add the next character.
   // You can call canEncode() to check if this algorithm will work at all.
   // Or you can skip that step, and always call encode, then call
@@ -90,9 +249,63 @@ public:
   void encode(char toEncode, HistorySummary const &historySummary,
 	      RansBlockWriter &writer);
 
-  char decode(char const *begin, char const *end, RansBlockReader &reader);
+  // Same as above, but someone else already asked the HistorySummary.
+  // smart is the result of historySummary.canEncode(toEncode).  If smart is
+  // true then range is the result of historySummary.encode(toEncode).  This
+  // allows us to build the HistorySummary objects in other threads.  Only
+  // this part has to be done in order.
+  void encode(char toEncode, bool smart, RansRange const &range,
+	      RansBlockWriter &writer);
+
+  // end is the position of the byte we are decoding.  The caller must add
+  // the result to index before calling decode() again.
+  char decode(HistoryIndex const &index, char const *end,
+	      RansBlockReader &reader);
 };
 
 
+// A segmented file is split into pieces that can be compressed and
+// decompressed independently, so we can use more than one thread in both
+// directions.  Each segment starts over with preloadContents and a new
+// TopLevel, so we lose a little compression at each boundary.
+//
+// Each segment is a complete RansBlockWriter stream, including its end of
+// file marker.  The segments are stored one after the other.  After the
+// last segment there is a table describing each segment, written as 32 bit
+// words:  offset, compressed size and original size, each as two words,
+// low word first.  Then the number of segments.  Then SEGMENTED_MAGIC.
+// The EightParameters header comes before the first segment.
+//
+// The header says which type of file we are looking at.  An ordinary file
+// must end right after its end of file marker.
+struct EightSegment
+{
+  uint64_t offset;
+  uint64_t compressedSize;
+  uint64_t originalSize;
+};
+
+static const uint32_t SEGMENTED_MAGIC = 0x6d38534d;
+
+// Returns the compressed data.
+std::string compressSegment(char const *begin, char const *end,
+			    EightParameters parameters);
+
+// Returns the original data.  Throws an exception if there's a problem,
+// including a segment bigger than parameters.maxSegmentSize().
+std::string decompressSegment(char const *fileName,
+			      EightSegment const &segment,
+			      EightParameters parameters);
+
+void writeSegmentTable(std::ostream &out,
+		       std::vector< EightSegment > const &segments);
+
+// Only call this if parameters.segmented().  Throws an exception if there's
+// a problem, including a missing table.  headerSize comes from readHeader().
+// An empty file has no segments.
+void readSegmentTable(char const *fileName, size_t headerSize,
+		      EightParameters const &parameters,
+		      std::vector< EightSegment > &segments);
+
 
 #endif
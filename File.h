@@ -2,15 +2,20 @@
 #define __File_h_
 
 #include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "Misc.h"
 
 
 // For simpliciy and performance, use mmap() to read the entire file into
-// memory.  This implementation is lacking a few things.  We can't handle
-// streaming data / pipes.  The file size is limited.  These have nothing to
-// do with the compressions algorithm.  You could make another implementation
-// which handles those cases better.
+// memory.  The file size is limited by the address space, not by memory.
+// Call sequential() and moveCursor() if you read a big file from front to
+// back.  Then we ask the kernel to read ahead of you and we let it drop the
+// pages that you're done with, so memory use doesn't grow with the file.
+// Use StreamReader, below, for pipes and other things we can't mmap().
 class File
 {
 private:
@@ -19,7 +24,15 @@ private:
   char const *_begin;
   char const *_end;
   std::string _errorMessage;
+  // See sequential().  0 means off.
+  size_t _lookback;
+  // Call advise() when the cursor gets here.
+  char const *_nextAdvice;
+  // Everything before this has been given back to the kernel.
+  char const *_released;
   static size_t roundUpToPageSize(size_t size);
+  static size_t roundDownToPageSize(size_t size);
+  void advise(char const *cursor);
 public:
   File(char const *name, size_t preambleSize = 0);
   File(char const *name, std::string const &preamble);
@@ -42,6 +55,78 @@ public:
   char const *preambleEnd() const { return begin(); }
 
   std::string const &errorMessage() const { return _errorMessage; }
+
+  // Ask for transparent huge pages.  Fewer TLB misses on a big file.  The
+  // kernel is free to ignore this, and most will for a file that's not in
+  // tmpfs.  Returns false if the kernel refused outright.
+  bool requestHugePages();
+
+  // We're going to read the file from front to back.  We'll never look at
+  // anything more than lookback bytes before the cursor.  After this, call
+  // moveCursor() as you go.
+  void sequential(size_t lookback);
+  // How far ahead of the cursor we ask the kernel to read.
+  static const size_t READ_AHEAD_BYTES = 8<<20;
+  // Cheap unless we've moved a long way since the last time.
+  void moveCursor(char const *cursor)
+  { if (cursor >= _nextAdvice) advise(cursor); }
+};
+
+
+// Read a pipe, a socket, etc., one chunk at a time.  A background thread
+// reads the next chunk while you work on the current one.
+//
+// This keeps the same promise as File's preamble:  you can always look
+// back from begin().  Before the first chunk you'll find the preamble.
+// Before any other chunk you'll find the last lookback bytes that came
+// before it.  Nothing further back is available.
+class StreamReader
+{
+private:
+  const int _fd;
+  // _preambleSize or lookback, whichever is bigger.
+  const size_t _lookback;
+  const size_t _chunkSize;
+  // Each buffer has _lookback bytes, then room for a chunk.
+  std::vector< char > _buffers[2];
+  // The buffer that the caller is using.
+  int _current;
+  size_t _currentSize;
+  // The other buffer.  Only the background thread touches these while
+  // _busy is true.
+  size_t _nextSize;
+  bool _nextEof;
+  std::string _errorMessage;
+  bool _eof;
+  std::thread _readerThread;
+  std::mutex _mutex;
+  std::condition_variable _condition;
+  bool _busy;
+  bool _done;
+  void backgroundReader();
+  void readChunk();
+public:
+  static const size_t DEFAULT_CHUNK_SIZE = 1<<20;
+  // We do not close fd.
+  StreamReader(int fd, std::string const &preamble, size_t lookback,
+	       size_t chunkSize = DEFAULT_CHUNK_SIZE);
+  // Waits for the background thread to finish its current read().
+  ~StreamReader();
+  StreamReader(const StreamReader&) =delete;
+  void operator=(const StreamReader&) =delete;
+
+  // Move on to the next chunk.  Returns false at the end of the input or if
+  // there was an error.  Everything from the previous chunk, except the
+  // lookback, is invalid after this.  Call this before looking at the
+  // first chunk.
+  bool next();
+  char const *begin() const
+  { return &_buffers[_current][_lookback]; }
+  char const *end() const { return begin() + _currentSize; }
+  size_t size() const { return _currentSize; }
+
+  bool valid() const { return _errorMessage.empty(); }
+  std::string const &errorMessage() const { return _errorMessage; }
 };
 
 
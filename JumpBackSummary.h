@@ -59,10 +59,21 @@ class JumpBackSummary
 private:
   uint8_t _howFar[9];
 public:
+  // How hard do we try to skip?  The compressor picks one and records it in
+  // the file so the decompressor can do the same thing.
+  //   NEVER looks at every position.  That's the slowest and the most
+  //     thorough.
+  //   STANDARD is the algorithm described above.  This is what we always did
+  //     before we had a choice.
+  //   AGGRESSIVE also skips most of the shorter matches that overlap a match
+  //     of 2 or more bytes, even when they might match a byte or two.  This
+  //     never changes what we do after a match of 0 or 1 bytes.
+  enum Mode { NEVER, STANDARD, AGGRESSIVE };
+
   // p points to the end of the buffer.  So we are looking at the 8 bytes
   // before p.  We do not look at *p.  This is consistent with
   // HistorySummary::getContext().
-  JumpBackSummary(char const *p);
+  JumpBackSummary(char const *p, Mode mode = STANDARD);
   uint8_t howFar(int matchLength) const { return _howFar[matchLength]; }
 };
 
@@ -1,12 +1,337 @@
 #ifndef __LzBlockShared_h_
 #define __LzBlockShared_h_
 
+#include <string.h>
+#include <assert.h>
+#include <ostream>
 #include <unordered_map>
-#include <unordered_set>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <stdexcept>
 
 #include "RansHelper.h"
 
 
+// A simple version of a string.
+//
+// A PString is only a pointer, a length and a cached hash.  It doesn't own
+// the bytes.  Someone else is responsible for memory management.  Typically
+// we're talking about strings that we've read from the input file or one
+// byte strings that are created when we first start the program.  Copying
+// a PString is cheap and never copies the bytes.
+//
+// Some methods, like join() and next(), will only treat two PString objects
+// identically if they are pointing to the exact same memory.  Most methods
+// treat two objects as the same as long as they contain identical data.
+// In particular, operator ==(), operator <() and std::hash() all focus on the
+// contents of the strings, not where they are in memory.  So you can use
+// a PString as the key in an STL container, just like you would with a
+// std::string.
+//
+// The hash is computed the first time someone asks for it, then it's saved
+// with the string.  Copies of the PString keep it.  So a string that we look
+// up in several tables, or that sits in a table while we look up other
+// things, only gets hashed once.  The saved hash describes the bytes as they
+// were at that time.  It stays valid as long as no one changes those bytes.
+// If you move the bytes somewhere else, make a new PString for the new
+// location.  hash() writes the cache from a const method, so don't share one
+// PString object between threads unless it's already been hashed.
+class PString
+{
+private:
+  char const *_begin;
+  size_t _length;
+  // 0 means we haven't computed it yet.  hashBytes() never returns 0.
+  mutable uint64_t _hash;
+public:
+  // 64 bits of hash, computed 8 bytes at a time.  Not cryptographic, just
+  // fast and well mixed.  The result is the same on every little endian
+  // machine, regardless of the compiler or the library.  It's never 0.
+  static uint64_t hashBytes(char const *begin, size_t length)
+  {
+    const uint64_t K = 0x9e3779b97f4a7c15ull;
+    uint64_t result = length * K;
+    const auto mix = [&result, K](uint64_t word) {
+      result = (result ^ word) * K;
+      result ^= result >> 29;
+    };
+    while (length >= 8)
+    {
+      uint64_t word;
+      memcpy(&word, begin, 8);
+      mix(word);
+      begin += 8;
+      length -= 8;
+    }
+    if (length)
+    {
+      uint64_t word = 0;
+      memcpy(&word, begin, length);
+      mix(word);
+    }
+    result ^= result >> 32;
+    result *= K;
+    result ^= result >> 29;
+    return result?result:1;
+  }
+
+  static std::vector< PString > const &oneByteStrings()
+  {
+    static char all[256];
+    static std::vector< PString > result;
+    if (result.empty())
+    {
+      for (int i = 0; i < 256; i++)
+      {
+	all[i] = i;
+	result.push_back(PString(&all[i], 1));
+      }
+    }
+    return result;
+  }
+  
+  PString() : _begin(NULL), _length(0), _hash(0) { }
+  PString(char const *begin, char const *end) :
+    _begin(begin), _length(end - begin), _hash(0) { assert(end >= begin); }
+  PString(char const *begin, size_t length) :
+    _begin(begin), _length(length), _hash(0)
+  { assert(_begin <= (_begin + _length)); }
+  bool operator <(PString const &other) const
+  {
+    const int direction =
+      memcmp(_begin, other._begin, std::min(_length, other._length));
+    if (direction < 0)
+      return true;
+    if (direction > 0)
+      return false;
+    return _length < other._length;
+  }
+  bool operator ==(PString const &other) const
+  {
+    if (_length != other._length)
+      return false;
+    if (_hash && other._hash && (_hash != other._hash))
+      // Cheap, if we already have both hashes.
+      return false;
+    return !memcmp(_begin, other._begin, _length);
+  }
+  uint64_t hash() const
+  {
+    if (!_hash)
+      _hash = hashBytes(_begin, _length);
+    return _hash;
+  }
+  bool empty() const { return _length == 0; }
+  size_t length() const { return _length; }
+  char const *begin() const { return _begin; }
+
+  // "ABCDE".removeFromFront(0) --> "ABCDE"
+  // "ABCDE".removeFromFront(3) --> "DE"
+  // "ABCDE".removeFromFront(5) --> ""
+  // "ABCDE".removeFromFront(7) --> undefined
+  void removeFromFront(size_t toRemove)
+  { // If we make this an assertion now, it's easy enough to change it later.
+    // We could say that removing too much makes the sting empty.  Or that it
+    // throws an exception.
+    assert(toRemove <= _length);
+    _begin += toRemove;
+    _length -= toRemove;
+    _hash = 0;
+  }
+
+  void removeFromEnd(size_t toRemove)
+  {
+    assert(toRemove <= _length);
+    _length -= toRemove;
+    _hash = 0;
+  }
+
+  // "A".isAPrefixOf("ABC") --> true
+  // "ABC".isAPrefixOf("ABC") --> true
+  // "ABCD".isAPrefixOf("ABC") --> false
+  // "A".isAPrefixOf("aABC") --> false
+  // "".isAPrefixOf(anything) --> true
+  // anythingButEmpty.isAPrefixOf("") --> false;
+  bool isAPrefixOf(PString const &longer) const
+  {
+    if (_length > longer._length) return false;
+    return !memcmp(_begin, longer._begin, _length);
+  }
+
+  PString join(PString const &second) const
+  {
+    assert(_begin + _length == second._begin);
+    return PString(_begin, _length + second._length);
+  }
+
+  PString next(int length) const
+  {
+    assert(_begin + _length + length >= _begin);
+    return PString(_begin + _length, length);
+  }
+};
+
+namespace std
+{
+  template<> struct hash< PString >
+  {
+    typedef PString argument_type;
+    typedef std::size_t result_type;
+    result_type operator()(argument_type const& string) const noexcept
+    {
+      return string.hash();
+    }
+  };
+}
+
+
+inline std::ostream &operator <<(std::ostream &out, PString const &s)
+{
+  return out.write(s.begin(), s.length());
+}
+
+
+// A hash table for the hot paths in LzBlock.  Open addressing with linear
+// probing, all in one array, so lookups don't chase pointers and inserts
+// don't call the allocator.  clear() keeps the memory, so a table that we
+// refill for every block only allocates while it's still growing.
+//
+// We save the full hash in each slot.  We only compare keys when the hashes
+// match.  std::hash< Key > should be cheap, like PString::hash().
+//
+// Unlike std::unordered_map, erase() and anything that inserts will move
+// other items around.  Don't hold a pointer across those calls.
+template < class Key, class Value >
+class OpenHashMap
+{
+private:
+  struct Slot
+  {
+    // 0 means this slot is empty.
+    uint64_t hash;
+    Key key;
+    Value value;
+    Slot() : hash(0), key(), value() { }
+  };
+  std::vector< Slot > _slots;
+  size_t _mask;
+  size_t _size;
+
+  static uint64_t hashOf(Key const &key)
+  {
+    const uint64_t result = std::hash< Key >()(key);
+    return result?result:1;
+  }
+
+  // Where this key is, or the empty slot where it would go.
+  size_t findSlot(Key const &key, uint64_t hash) const
+  {
+    size_t i = hash & _mask;
+    while (_slots[i].hash
+	   && ((_slots[i].hash != hash) || !(_slots[i].key == key)))
+      i = (i + 1) & _mask;
+    return i;
+  }
+
+  void resize(size_t slotCount)
+  {
+    std::vector< Slot > old;
+    old.swap(_slots);
+    _slots.resize(slotCount);
+    _mask = slotCount - 1;
+    for (Slot &slot : old)
+      if (slot.hash)
+	_slots[findSlot(slot.key, slot.hash)] = std::move(slot);
+  }
+
+public:
+  OpenHashMap() : _slots(16), _mask(15), _size(0) { }
+
+  size_t size() const { return _size; }
+  bool empty() const { return !_size; }
+
+  // Make room for this many items without growing.
+  void reserve(size_t count)
+  {
+    size_t slotCount = _slots.size();
+    // At most half full.
+    while (slotCount < count * 2)
+      slotCount *= 2;
+    if (slotCount != _slots.size())
+      resize(slotCount);
+  }
+
+  // Remove everything but keep the memory.
+  void clear()
+  {
+    if (_size)
+    {
+      for (Slot &slot : _slots)
+	slot = Slot();
+      _size = 0;
+    }
+  }
+
+  Value *find(Key const &key)
+  {
+    Slot &slot = _slots[findSlot(key, hashOf(key))];
+    return slot.hash?&slot.value:NULL;
+  }
+  bool count(Key const &key) const
+  {
+    return _slots[findSlot(key, hashOf(key))].hash;
+  }
+
+  // Like std::map, add a default value if the key isn't already there.
+  Value &operator [](Key const &key)
+  {
+    const uint64_t hash = hashOf(key);
+    size_t i = findSlot(key, hash);
+    if (!_slots[i].hash)
+    {
+      if ((_size + 1) * 2 > _slots.size())
+      {
+	resize(_slots.size() * 2);
+	i = findSlot(key, hash);
+      }
+      _slots[i].hash = hash;
+      _slots[i].key = key;
+      _size++;
+    }
+    return _slots[i].value;
+  }
+
+  // Returns true if we found it.
+  bool erase(Key const &key)
+  {
+    size_t i = findSlot(key, hashOf(key));
+    if (!_slots[i].hash)
+      return false;
+    // Backward shift deletion.  Move later items in the same run into the
+    // hole, when that's no further from their home slot.  No tombstones.
+    size_t j = i;
+    while (true)
+    {
+      j = (j + 1) & _mask;
+      if (!_slots[j].hash)
+	break;
+      const size_t home = _slots[j].hash & _mask;
+      // Can the item in slot j move to slot i?  Only if its home is not
+      // in the range (i, j], going around the end of the array.
+      if (((j - home) & _mask) >= ((j - i) & _mask))
+      {
+	_slots[i] = std::move(_slots[j]);
+	i = j;
+      }
+    }
+    _slots[i] = Slot();
+    _size--;
+    return true;
+  }
+};
+
+
 class WriteStats
 {
 private:
@@ -80,12 +405,12 @@ public:
  * The main program constrols the max size of the list, by adding or deleting
  * strings.  If this is is too small, you
  * limit the amount of compression you can get from this stage.  If you make
- * this too big you get diminishing returns.  Operations on this list, and
- * this corresponding list of frequencies used by the rANS step, are often
- * O(n) where n is either the position of the string in the list, or the
- * maximum size of the list.  There are constant attempts to optimize these
- * data structures, but you can't completely get rid of that O(n), so you want
- * to keep the table small so n will be small. */
+ * this too big you get diminishing returns.  Operations on this list used to
+ * be O(n) where n is the size of the list, which was a good reason to keep
+ * the list small.  Now finding, promoting, adding and deleting are all
+ * O(log n).  See the notes on _stampOf below.  Restoring from the recycle
+ * bin at the start of a block is still O(n), but that only happens once per
+ * block. */
 template < class T >
 class MruBase 
 {
@@ -94,7 +419,37 @@ private:
   const size_t _maxRecycle;
   size_t _size;
   size_t _lowPriorityCount;
-  std::vector< T > _items;
+
+  /* The visible part of the list, index 0 to size() - 1, is stored by
+   * timestamp.  Every time an item moves to the front of the list it gets a
+   * new timestamp, bigger than any other.  So the list, from front to back,
+   * is the items sorted by timestamp, newest first.  An item's index is the
+   * number of items with a newer timestamp.
+   *
+   * _byStamp[stamp] is the item with that timestamp, if _live[stamp] is
+   * true.  Moving an item to the front only marks its old timestamp as dead,
+   * so we don't have to shift anything.  _tree is a Fenwick tree (a.k.a.
+   * binary indexed tree) over _live.  Same idea as SymbolCounter.  That
+   * gives us the index of a timestamp, or the timestamp at an index, in
+   * O(log n).  _stampOf lets us find a string's timestamp without looking
+   * at every item.
+   *
+   * When we run out of timestamps we renumber everything, which is O(n).
+   * We always leave at least n unused timestamps, so that's O(1) amortized.
+   *
+   * The recycle bin is only ever touched at the ends, so it's a deque.
+   * _recycleBin.front() is index size(). */
+  std::vector< T > _byStamp;
+  std::vector< char > _live;
+  std::vector< uint32_t > _tree;
+  // The largest power of 2 that is < _tree.size().
+  size_t _topStep;
+  size_t _nextStamp;
+  OpenHashMap< T, size_t > _stampOf;
+  std::deque< T > _recycleBin;
+  // Only used in restoreAllFromRecycleBin().  Saved here so we can reuse the
+  // memory.
+  OpenHashMap< T, bool > _restored;
 
   bool isLowPriority(size_t index) const
   {
@@ -108,12 +463,123 @@ private:
   // this, but then resurect it when the next block starts.
   static bool oneByteString(T const &string) { return string.length() == 1; }
   static bool equal(T const &a, T const &b) { return a == b; }
-  typedef typename std::unordered_set< T > Set;
+
+  static size_t lowBit(size_t i) { return i & -i; }
+  void treeAdd(size_t stamp, int delta)
+  {
+    for (size_t i = stamp + 1; i < _tree.size(); i += lowBit(i))
+      _tree[i] += delta;
+  }
+  // The index of the item with this timestamp.
+  size_t indexOf(size_t stamp) const
+  { // Count the live timestamps up to and including this one.  The rest are
+    // newer.
+    size_t olderOrSame = 0;
+    for (size_t i = stamp + 1; i; i -= lowBit(i))
+      olderOrSame += _tree[i];
+    return _size - olderOrSame;
+  }
+  // The timestamp of the item at this index.
+  size_t stampAt(size_t index) const
+  {
+    assert(index < _size);
+    // Index 0 is the newest, so it's the last of _size live timestamps.
+    size_t remaining = _size - index;
+    size_t found = 0;
+    for (size_t step = _topStep; step; step /= 2)
+      if ((found + step < _tree.size()) && (_tree[found + step] < remaining))
+      {
+	found += step;
+	remaining -= _tree[found];
+      }
+    // _tree[found + 1] is where we reach remaining, so that's the one.
+    return found;
+  }
+  T const &at(size_t index) const
+  {
+    if (index < _size)
+      return _byStamp[stampAt(index)];
+    else
+      return _recycleBin[index - _size];
+  }
+
+  // The visible part of the list, front first.  O(n).
+  std::vector< T > visibleItems() const
+  {
+    std::vector< T > result;
+    result.reserve(_size);
+    for (size_t stamp = _nextStamp; stamp > 0; )
+    {
+      stamp--;
+      if (_live[stamp])
+	result.push_back(_byStamp[stamp]);
+    }
+    return result;
+  }
+
+  // Replace the visible part of the list.  inOrder[0] will be at index 0.
+  void rebuild(std::vector< T > const &inOrder)
+  {
+    const size_t size = inOrder.size();
+    const size_t capacity = std::max(size * 2, (size_t)1024);
+    _byStamp.assign(capacity, T());
+    _live.assign(capacity, 0);
+    _tree.assign(capacity + 1, 0);
+    _stampOf.clear();
+    _stampOf.reserve(capacity);
+    // Oldest first, so if there's a duplicate, _stampOf ends up pointing to
+    // the newer copy.  See addToFront().
+    for (size_t stamp = 0; stamp < size; stamp++)
+    {
+      T const &item = inOrder[size - 1 - stamp];
+      _byStamp[stamp] = item;
+      _live[stamp] = 1;
+      _stampOf[item] = stamp;
+    }
+    // O(n), the same way as SymbolCounter::rebuild().
+    for (size_t i = 1; i <= capacity; i++)
+    {
+      _tree[i] += _live[i-1];
+      const size_t parent = i + lowBit(i);
+      if (parent <= capacity)
+	_tree[parent] += _tree[i];
+    }
+    _topStep = 1;
+    while (_topStep * 2 <= capacity)
+      _topStep *= 2;
+    _nextStamp = size;
+    _size = size;
+  }
+
+  void pushFront(T const &item)
+  {
+    if (_nextStamp == _byStamp.size())
+      // Out of timestamps.
+      rebuild(visibleItems());
+    const size_t stamp = _nextStamp++;
+    _byStamp[stamp] = item;
+    _live[stamp] = 1;
+    treeAdd(stamp, 1);
+    _size++;
+    // See addToFront() for a discussion of duplicates.
+    _stampOf[item] = stamp;
+  }
+
+  void remove(size_t stamp)
+  {
+    assert(_live[stamp]);
+    _live[stamp] = 0;
+    treeAdd(stamp, -1);
+    _size--;
+    size_t const *const current = _stampOf.find(_byStamp[stamp]);
+    if (current && (*current == stamp))
+      _stampOf.erase(_byStamp[stamp]);
+  }
 
   // Move one item from index i to index 0.  All the items between 0 and i
   // get moved one index higher to make room.  Every index above i remains
   // unchanged.
-  void promote(size_t i)
+  void promote(size_t stamp, size_t i)
   { // This should never fail, even with a bad input file.  We tell rANS how
     // big a number we expect, based on the current size() of this table.
     assert(i < _size);
@@ -121,16 +587,21 @@ private:
     {
       _lowPriorityCount--;
     }
-    std::rotate(_items.begin(), _items.begin() + i, _items.begin() + i + 1);
+    if (i)
+    { // Copy the item first.  remove() doesn't erase it, but pushFront()
+      // might renumber everything.
+      const T item = _byStamp[stamp];
+      remove(stamp);
+      pushFront(item);
+    }
   }
 
   // If there are too many items in the recycle bin, remove the extras.
   void trimRecycleBin()
   {
-    auto const recyclerSize = _items.size() - _size;
-    if (recyclerSize > _maxRecycle)
+    if (_recycleBin.size() > _maxRecycle)
     { 
-      _items.resize(_size + _maxRecycle);
+      _recycleBin.resize(_maxRecycle);
     }
   }
   
@@ -144,7 +615,8 @@ public:
   // with the same lists.
   MruBase(std::vector< T > const &oneByteStrings, size_t maxRecycle) :
     _oneByteStrings(oneByteStrings),
-    _maxRecycle(maxRecycle), _size(0), _lowPriorityCount(0)
+    _maxRecycle(maxRecycle), _size(0), _lowPriorityCount(0),
+    _topStep(0), _nextStamp(0)
   { // Set everything to the beginning of block state.
     restoreAllFromRecycleBin();
   }
@@ -165,28 +637,29 @@ public:
   FoundAt findAndPromote(T const &item)
   {
     FoundAt result;
-    for (size_t i = 0; i < _size; i++)
-      if (equal(item, _items[i]))
+    size_t const *const found = _stampOf.find(item);
+    if (found)
+    {
+      const size_t stamp = *found;
+      const size_t i = indexOf(stamp);
+      const size_t lowPriorityStart = _size - _lowPriorityCount;
+      if (i >= lowPriorityStart)
       {
-	const size_t lowPriorityStart = _size - _lowPriorityCount;
-	if (i >= lowPriorityStart)
-	{
-	  result = FoundAt(Group::RECYCLED, i - lowPriorityStart);
-	}
-	else
-	{
-	  result = FoundAt(Group::MAIN, i);
-	}
-	promote(i);
-	break;
+	result = FoundAt(Group::RECYCLED, i - lowPriorityStart);
+      }
+      else
+      {
+	result = FoundAt(Group::MAIN, i);
       }
+      promote(stamp, i);
+    }
     return result;
   }
 
   // This is the item we just found with findAndPromote().  The encoder
   // sometimes prints this when doing verbose debugging.  The decoder uses this
   // to grab the actual bytes we need to copy to the output.
-  T const &getFront() const { return _items[0]; }
+  T const &getFront() const { return at(0); }
 
   // This is used by the decoder.  When the encoder called findAndPromote() on
   // a string to get a number, then the decoder calls findAndPromote() on its
@@ -195,7 +668,7 @@ public:
   // to the front of the list, so they stay synchronized with each other.
   T const &findAndPromote(size_t index)
   {
-    promote(index);
+    promote(stampAt(index), index);
     return getFront();
   }
 
@@ -258,7 +731,7 @@ public:
   // you just did the grab and you have not called delete since then.
   bool isRecentDuplicate(T const &item, bool recentDelete) const
   {
-    return equal(item, _items[recentDelete?0:1]);
+    return equal(item, at(recentDelete?0:1));
   }
 
   // Add a new string to the table.  Its index will initially be 0.  All other
@@ -267,11 +740,13 @@ public:
   // Do not add any duplicates to the table!  We do not enforce that invariant
   // here because it would be way too inefficient.  However, any strategy that
   // led you to put duplicates in the table would not give you optimal
-  // compression.  If there is a duplicate, that's a programming error.
+  // compression.  If there is a duplicate, that's a programming error.  (If
+  // it happens anyway, findAndPromote() will find the newer copy, the same
+  // as a linear search would.  But once that copy is deleted, it won't find
+  // the older one.)
   void addToFront(T const &toAdd)
   {
-    _items.insert(_items.begin(), toAdd);
-    _size++;
+    pushFront(toAdd);
   }
 
   // Removes the item at index 0, the front of the list.  All other items
@@ -304,19 +779,16 @@ public:
   // block's recycle bin.
   void deleteFront()
   {
-    if (oneByteString(*_items.begin()))
-    { // Remove it completely.  We'll recreate it when we start the next
-      // block.
-      std::rotate(_items.begin(), _items.begin() + 1, _items.end());
-      _size--;
-      _items.resize(_items.size()-1);
-    }
-    else
+    const size_t stamp = stampAt(0);
+    const T item = _byStamp[stamp];
+    remove(stamp);
+    if (!oneByteString(item))
     {
-      std::rotate(_items.begin(), _items.begin() + 1, _items.begin() + _size);
-      _size--;
+      _recycleBin.push_front(item);
       trimRecycleBin();
     }
+    // Else remove it completely.  We'll recreate it when we start the next
+    // block.
   }
 
   void restoreAllFromRecycleBin()
@@ -326,19 +798,33 @@ public:
     //
     // These items are all going into the same bin.  So the order doesn't
     // matter.  The probability associated with each of these items will be
-    // identical, regardless of their location in the bin.
-    Set recycle;
+    // identical, regardless of their location in the bin.  But the encoder
+    // and decoder have to agree on it.  So we keep them in the order we
+    // first saw them.  That doesn't depend on the hash function or the
+    // library.
+    std::vector< T > recycle;
+    recycle.reserve(_maxRecycle + _oneByteStrings.size());
+    _restored.clear();
+    _restored.reserve(_maxRecycle + _oneByteStrings.size());
+    const auto insert = [this, &recycle](T const &item) {
+      bool &seen = _restored[item];
+      if (!seen)
+      {
+	seen = true;
+	recycle.push_back(item);
+      }
+    };
 
     // The one byte strings are always available at the start of a block.
-    recycle.insert(_oneByteStrings.begin(), _oneByteStrings.end());
-
-    auto const recycleStart = visibleEnd();
+    for (T const &item : _oneByteStrings)
+    {
+      insert(item);
+    }
 
     // We were holding these items specifically to recycle them.
-    //recycle.insert(recycleStart, _items.end());
-    for (auto it = recycleStart; it != _items.end(); it++)
+    for (T const &item : _recycleBin)
     {
-      recycle.insert(*it);
+      insert(item);
     }
     
     // Any remaining items in the original list were left over from the
@@ -346,18 +832,18 @@ public:
     // in the previous block, but they were restored from the recycle bin
     // right before we started working on that block.  Add these only if we
     // have room.
-    for (auto it = _items.begin();
-	 (it < recycleStart)
+    const std::vector< T > visible = visibleItems();
+    for (auto it = visible.begin();
+	 (it < visible.end())
 	   && (recycle.size() < _maxRecycle + _oneByteStrings.size());
 	 it++)
     {
-      recycle.insert(*it);
+      insert(*it);
     }
 
     // Replace the old list with the new list.  Empty the recyle bin.
-    _items.clear();
-    _items.insert(_items.end(), recycle.begin(), recycle.end());
-    _size = _items.size();
+    rebuild(recycle);
+    _recycleBin.clear();
 
     // Everything that we save from the previous block is just a guess.
     // The probability of grabbing one of these items is lower than the
@@ -365,12 +851,312 @@ public:
     _lowPriorityCount = _size;
   }
   
-  // The entire internal state.  getAll().begin() is the front of the list.
-  // visibleEnd() is the end of the list and the beginning of the recycle bin.
-  // getAll().end() is the end of the recycle bin.
-  typename std::vector< T > const &getAll() { return _items; }
-  typename std::vector< T >::const_iterator visibleEnd() const
-  { return _items.begin() + _size; }
+  // A copy of the entire internal state.  getAll().begin() is the front of
+  // the list.  getAll().begin() + size() is the end of the list and the
+  // beginning of the recycle bin.  getAll().end() is the end of the recycle
+  // bin.  O(n).
+  std::vector< T > getAll() const
+  {
+    std::vector< T > result = visibleItems();
+    result.insert(result.end(), _recycleBin.begin(), _recycleBin.end());
+    return result;
+  }
 };
 
+/* IndexBins describes how we send an MRU index to rANS.
+ *
+ * We group the indexes into bins.  The compressor counts how many times each
+ * bin is used in the entire block, and it saves those counts in the block
+ * header.  Each time we write an index, first we write the bin number, with
+ * a probability proportional to the remaining count for each bin.  Then we
+ * write the position in the bin, with every position equally likely.  Then
+ * we decrement the count for that bin.  The decompressor reads the same
+ * counts from the block header and follows the same steps.
+ *
+ * Bin sizes can be almost anything, as long as both sides agree.
+ * Fibonocci seemed pretty close to what I wanted, and it was easy
+ * to do.
+ *
+ * Some experimenting suggests that I'm being too precise on the front
+ * end.  The first one is often much different from the rest.  But none
+ * of the indicies has a huge number of entries, so giving a lot of weight
+ * to any single index does not make that much sense.
+ *
+ * Everything in the low priority part of the list, i.e. the strings that we
+ * restored from the recycle bin and haven't used yet in this block, goes
+ * into one more bin.
+ *
+ * The normal bins have to cover every index that the block might use.  Each
+ * string adds at most one entry to the list, so the list never holds more
+ * than the size at the start of the block plus the number of strings in the
+ * block.  We always make at least the original 21 normal bins.  After that
+ * we keep adding Fibonocci sized bins until we cover the whole list.  Each
+ * extra bin costs one word in the block header. */
+class IndexBins
+{
+public:
+  // The low priority bin and the normal bins that every block has.
+  static const int MIN_BIN_COUNT = 22;
+private:
+  struct BinInfo
+  {
+    int begin;
+    int end;
+    int count;
+    int size() const { return end-begin; }
+    bool valid() const { return begin >= 0; }
+    BinInfo() : begin(-1), end(-1), count(0) { }
+    BinInfo(int begin, int end) :
+      begin(begin), end(end), count(0) { }
+  };
+  BinInfo _lowPriority;
+  // The normal bins, in order.  The last one is invalid.  If you try to read
+  // off the end of the table you get that.
+  std::vector< BinInfo > _bins;
+
+  BinInfo *indexToBin(FoundAt foundAt)
+  {
+    switch (foundAt.group)
+    {
+    case Group::MAIN:
+    {
+      for (auto it = _bins.rbegin(); it != _bins.rend(); it++)
+	if (it->valid() && ((int)foundAt.index >= it->begin))
+	  return ((int)foundAt.index < it->end)?&*it:NULL;
+      return NULL;
+    }
+    case Group::RECYCLED:
+      return &_lowPriority;
+    default:
+      return NULL;
+    }
+  }
+
+  // The bins that are possible when the high priority part of the list has
+  // maxIndex items.  That's the low priority bin, then the normal bins, up
+  // to and including the one that holds maxIndex - 1.  Only part of the
+  // last bin is possible, so we prorate its count.  We return the last bin.
+  BinInfo *lastPossible(uint32_t maxIndex, uint32_t &total,
+			uint32_t &lastBinProratedCount)
+  {
+    BinInfo *maxBin = &_lowPriority;
+    total = 0;
+    for (BinInfo &nextBin : _bins)
+    {
+      total += maxBin->count;
+      // The constructor promised that the bins reach maxIndex, so we never
+      // go past the last valid bin.
+      if (!nextBin.valid() || (maxIndex <= (uint32_t)nextBin.begin))
+	break;
+      maxBin = &nextBin;
+    }
+    lastBinProratedCount =
+      (maxBin == &_lowPriority)
+      ?maxBin->count
+      :(maxBin->count * (maxIndex - maxBin->begin) + maxBin->size()-1)
+      / maxBin->size();
+    // Yes, the last bin gets counted twice.  Once in full and once prorated.
+    // That wastes a little space, but changing it would change the file
+    // format.
+    total += lastBinProratedCount;
+    return maxBin;
+  }
+
+  // The number of positions in this bin that are currently possible.
+  uint32_t positionCount(BinInfo const *bin, BinInfo const *maxBin,
+			 uint32_t maxIndex) const
+  {
+    if ((bin == maxBin) && (bin != &_lowPriority))
+      // We are refering to the last bin that is currently possible.
+      // Parts of this bin might also be impossible.  Modify the normal
+      // size() method to stop at the highest currently possible index.
+      // Note that the lowPriority bin works a little differently, so we
+      // never want to use this special logic on that bin.
+      return maxIndex - bin->begin;
+    else
+      return bin->size();
+  }
+
+  void used(BinInfo *bin)
+  {
+    bin->count--;
+    if (bin == &_lowPriority)
+    {
+      bin->end--;
+    }
+  }
+
+public:
+  // mruSize is the size of the list at the start of the block.  All of those
+  // items are low priority.  The high priority part of the list will never
+  // hold more than maxListSize items.
+  IndexBins(size_t mruSize, size_t maxListSize) : _lowPriority(0, mruSize)
+  {
+    // Keep everything in an int.  A list that long wouldn't fit in memory.
+    maxListSize = std::min(maxListSize, (size_t)MAX_LIST_SIZE);
+    int previousSize = 0;
+    int size = 1;
+    int indexStart = 0;
+    while (((int)_bins.size() < MIN_BIN_COUNT - 1)
+	   || ((size_t)indexStart < maxListSize))
+    {
+      const int nextIndexStart = indexStart + size;
+      _bins.emplace_back(indexStart, nextIndexStart);
+      indexStart = nextIndexStart;
+      const int nextSize = size + previousSize;
+      previousSize = size;
+      size = nextSize;
+    }
+    _bins.emplace_back();
+  }
+
+  static const size_t MAX_LIST_SIZE = 1<<30;
+
+  // The number of counts in the block header.
+  size_t binCount() const { return _bins.size(); }
+
+  // The compressor calls this on every index in the block before it calls
+  // encode() on any of them.
+  void count(FoundAt foundAt)
+  {
+    BinInfo *const bin = indexToBin(foundAt);
+    assert(bin);
+    bin->count++;
+  }
+
+  // What goes into the block header.  The low priority bin first.
+  std::vector< uint32_t > getCounts() const
+  {
+    std::vector< uint32_t > result;
+    result.push_back(_lowPriority.count);
+    for (size_t i = 0; i < _bins.size() - 1; i++)
+      result.push_back(_bins[i].count);
+    return result;
+  }
+
+  // The decompressor calls this with the counts from the block header.
+  // There are binCount() of them.
+  void setCounts(uint32_t const *counts)
+  {
+    _lowPriority.count = counts[0];
+    for (size_t i = 0; i < _bins.size() - 1; i++)
+      _bins[i].count = counts[i+1];
+  }
+
+  // maxIndex is the number of high priority items in the list.
+  void encode(FoundAt foundAt, uint32_t maxIndex,
+	      std::vector< RansRange > &toEntropyEncoder)
+  {
+    BinInfo *const binToWrite = indexToBin(foundAt);
+    uint32_t maxCount;
+    uint32_t lastBinProratedCount;
+    BinInfo *const maxBin =
+      lastPossible(maxIndex, maxCount, lastBinProratedCount);
+    uint32_t writeStart = 0;
+    if (binToWrite != &_lowPriority)
+    {
+      writeStart += _lowPriority.count;
+      for (auto it = _bins.begin(); &*it != binToWrite; it++)
+	writeStart += it->count;
+    }
+    const size_t countInThisBin =
+      (binToWrite == maxBin)?lastBinProratedCount:binToWrite->count;
+
+    // Write the bin number.
+    toEntropyEncoder.emplace_back(writeStart, countInThisBin, maxCount);
+    assert(toEntropyEncoder.rbegin()->valid());
+
+    { // WRITE the position in the bin
+      // Start with the position of the item relative to its bin.
+      const uint32_t start = foundAt.index - binToWrite->begin;
+      // Every index in a bin has the same probability as every other
+      // index in the same bin.
+      const uint32_t freq = 1;
+      // The denominator is the number of unique values that could be saved
+      // in the bin.
+      const uint32_t scaleEnd = positionCount(binToWrite, maxBin, maxIndex);
+      toEntropyEncoder.emplace_back(start, freq, scaleEnd);
+      assert(toEntropyEncoder.rbegin()->valid());
+    }
+
+    used(binToWrite);
+  }
+
+  // The inverse of encode().  Throws an exception if the input doesn't make
+  // sense.  You still have to check the result against the size of the list.
+  FoundAt decode(uint32_t maxIndex, Rans64State *r, uint32_t **pptr)
+  {
+    uint32_t maxCount;
+    uint32_t lastBinProratedCount;
+    BinInfo *const maxBin =
+      lastPossible(maxIndex, maxCount, lastBinProratedCount);
+    const uint32_t value = RansRange::get(maxCount, r);
+    // Walk through the bins in the same order as lastPossible().
+    BinInfo *bin = &_lowPriority;
+    uint32_t start = 0;
+    auto next = _bins.begin();
+    while (true)
+    {
+      const uint32_t freq =
+	(bin == maxBin)?lastBinProratedCount:bin->count;
+      if (value < start + freq)
+      {
+	RansRange(start, freq, maxCount).advance(r, pptr);
+	break;
+      }
+      if (bin == maxBin)
+	throw std::runtime_error("Corrupt file.");
+      start += freq;
+      bin = &*next;
+      next++;
+    }
+    const uint32_t scaleEnd = positionCount(bin, maxBin, maxIndex);
+    const uint32_t position = RansRange::get(scaleEnd, r);
+    if (position >= scaleEnd)
+      throw std::runtime_error("Corrupt file.");
+    RansRange(position, 1, scaleEnd).advance(r, pptr);
+    const FoundAt result((bin == &_lowPriority)?Group::RECYCLED:Group::MAIN,
+			 bin->begin + position);
+    used(bin);
+    return result;
+  }
+
+  // Did we use everything that we counted?
+  bool empty() const
+  {
+    if (_lowPriority.count)
+      return false;
+    for (BinInfo const &bin : _bins)
+      if (bin.count)
+	return false;
+    return true;
+  }
+};
+
+
+/* The LzBlock file format:
+ *
+ * All numbers are 32 bit words, little endian.  The file starts with
+ * LZ_BLOCK_MAGIC then the size of the original file in bytes, as a 64 bit
+ * number, low word first.
+ *
+ * Then come the blocks.  Each block starts with the number of strings in
+ * the block.  0 means the end of the file, and nothing else follows it.
+ * Otherwise the next word is the number of words of rANS data, then the
+ * IndexBins::binCount() counts from IndexBins::getCounts(), then the rANS
+ * data.  There are at least IndexBins::MIN_BIN_COUNT counts, more if the
+ * MRU list might get long enough to need them.  We use one rANS state per
+ * block, so the decoder starts with Rans64DecInit() and should end exactly
+ * where the rANS data ends.
+ *
+ * For each string the rANS data contains:
+ *  o The index of the string in the MRU list.  See IndexBins.
+ *  o A yes/no.  Should we delete that string from the list?
+ *  o A yes/no.  Should we add the last two strings, concatenated, to the
+ *    list?  That's skipped for the first string in the block and when
+ *    MruBase::isRecentDuplicate() says the new string is already there. */
+const uint32_t LZ_BLOCK_MAGIC = 0x4b4c425a;
+// The smallest possible block header.
+const int LZ_BLOCK_MIN_HEADER_WORDS = 2 + IndexBins::MIN_BIN_COUNT;
+
 #endif
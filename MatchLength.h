@@ -0,0 +1,39 @@
+#ifndef __MatchLength_h_
+#define __MatchLength_h_
+
+#include <stdint.h>
+
+
+/* This is the inner loop of HistorySummary, without the JumpBackSummary
+ * logic.
+ *
+ * For each position between begin and end we look at the 8 bytes right
+ * before that position.  That's the context for that position.  We compare
+ * that to the 8 bytes right before contextEnd.  How many bytes match,
+ * starting from the byte closest to the position?  That's a number between
+ * 0 and 8, the same as HistorySummary::matchingByteCount().
+ *
+ * The original code loaded each context as an int64_t, used xor and
+ * __builtin_clzl() to count the matching bytes, and did that one position at
+ * a time.  That's still the fallback.  But we can get the same answer 16 or
+ * 32 positions at a time.  Compare all of the positions to the first byte of
+ * context at once.  Then compare all of the positions to the second byte of
+ * context at once.  Etc.  A position's match length is the number of
+ * comparisons that succeeded before the first one that failed.
+ *
+ * We pick the fastest version that the current CPU supports at run time.
+ * All versions give exactly the same results, so the compressed files are
+ * the same regardless of the machine that created them.
+ *
+ * lengths[0] is the result for begin, lengths[1] is the result for begin + 1,
+ * etc.  We write end - begin entries.  We will read from begin - 8 up to
+ * but not including end - 1, and the 8 bytes before contextEnd.
+ */
+void matchLengths(char const *contextEnd, char const *begin, char const *end,
+		  uint8_t *lengths);
+
+// The name of the version that matchLengths() is using.  For debugging and
+// benchmarks.
+char const *matchLengthsImplementation();
+
+#endif
@@ -1,23 +1,98 @@
 #ifndef __RansBlockReader_h__
 #define __RansBlockReader_h__
 
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
 #include "RansHelper.h"
 #include "File.h"
 
 // Most of these methods will throw a RuntimeError if there's a problem.
 
 // This is the inverse of RansBlockWriter.
+//
+// We can read from a file, which we mmap all at once, or from a file
+// descriptor, e.g. stdin.  A file descriptor might be a pipe, so we can't
+// seek and we don't know how long it is.  We read it in chunks.  _next and
+// _end point into _buffer, which holds the words from the current chunk that
+// we haven't used yet.  A background thread reads the next chunk into
+// _readAhead while we decode the current one.
+//
+// A block header only says how many symbols are in the block, not how many
+// words.  But each symbol reads at most one word.  So eof() makes sure we
+// have at least one word before each symbol, and enough words for the
+// header and the initial states before each block.  That works the same for
+// both sources.  A valid stream always has at least one more word, the end
+// of file marker, so this check also catches a truncated file as soon as
+// possible.
 class RansBlockReader
 {
 private:
-  File _file;
+  // NULL if we are reading from a file descriptor.
+  std::unique_ptr< File > _file;
+  // -1 if we are reading from _file.
+  const int _fd;
   uint32_t *_next;
   const uint32_t *_end;
   int32_t _remainingInBlock;
-  Rans64State _ransState;
-  
+  // See RANS_BLOCK_COUNT_BITS in RansHelper.h.
+  Rans64State _ransStates[RANS_MAX_INTERLEAVE];
+  int _interleave;
+  // Which state will decode the next symbol.
+  int _current;
+  // Someone used _current since the last call to eof().  getNext() can't
+  // move on to the next state itself because the caller might or might not
+  // have already called getRansState().
+  bool _used;
+
+  // Only used with a file descriptor.  Always has at least one spare word
+  // after _end.  See eof().
+  std::vector< uint32_t > _buffer;
+  std::vector< char > _readAhead;
+  size_t _readAheadBytes;
+  bool _readAheadEof;
+  std::string _readAheadError;
+  // There is nothing left to read after what's in _buffer.
+  bool _inputFinished;
+  std::thread _readerThread;
+  std::mutex _mutex;
+  std::condition_variable _condition;
+  // The background thread owns _readAhead and is filling it.
+  bool _busy;
+  // Tell the background thread to exit.
+  bool _done;
+
+  int64_t _blockCount;
+  int64_t _chunkCount;
+  int64_t _stallMicroseconds;
+
+  // Make sure there are at least this many words between _next and _end.
+  // Returns false if the input ends first.
+  bool makeAvailable(size_t words)
+  { return ((size_t)(_end - _next) >= words) || refill(words); }
+  bool refill(size_t words);
+  void readChunk();
+  void backgroundReader();
+
 public:
   RansBlockReader(char const *fileName);
+  // Only read the part of the file starting at offset and containing length
+  // bytes.  That part must be a complete stream from RansBlockWriter,
+  // including the end of file marker.  By default we read everything after
+  // offset, e.g. to skip over a header.
+  RansBlockReader(char const *fileName, size_t offset,
+		  size_t length = TO_END);
+  static const size_t TO_END = (size_t)-1;
+  // Read from a pipe, a socket, etc.  We do not close fd.  alreadyRead is
+  // the start of the stream, if the caller had to look at it first.  See
+  // EightParameters::readHeader().
+  RansBlockReader(int fd, std::string const &alreadyRead = "");
+  // Waits for the background thread to finish its current read().
+  ~RansBlockReader();
+  RansBlockReader(const RansBlockReader&) =delete;
+  void operator=(const RansBlockReader&) =delete;
   bool eof();  // Explicitly not const.
 
   // First call get() to get the next number.  You should already have a list
@@ -36,11 +111,20 @@ public:
   // Then do a get followed by an advance.  3 steps every time.
   //
   // Super duper ugly.
-  uint32_t **getNext() { _remainingInBlock--; return &_next; }
-  Rans64State *getRansState() { return &_ransState; }
-  
-  void dumpStats(std::ostream &out);
+  uint32_t **getNext() { _remainingInBlock--; _used = true; return &_next; }
+  Rans64State *getRansState() { return &_ransStates[_current]; }
+
+  // True after we've read the last symbol in a block, until the next eof().
+  // That eof() might have to wait for more input.  A streaming decoder
+  // should flush its output here.
+  bool betweenBlocks() const { return !_remainingInBlock; }
 
+  // Is there anything after the end of file marker?  Only call this after
+  // eof() returns true.  A segmented file from Eight has more segments and a
+  // segment table after the first end of file marker.
+  bool moreAfterEof();
+
+  void dumpStats(std::ostream &out);
 };
 
 
@@ -2,23 +2,119 @@
 #define __RansBlockWrite_h_
 
 #include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include "RansHelper.h"
 
 
+/* The encoder should never wait for the allocator or the disk.
+ *
+ * We encode each block into _arena, a buffer that we allocate once, up
+ * front.  It's big enough for the largest possible block, so we never have
+ * to grow it.  rANS writes from right to left, so the finished block ends
+ * at the end of _arena.
+ *
+ * Then we copy the finished block into _pending.  When _pending is full we
+ * swap it with _writing and a background thread sends _writing to the
+ * stream.  The encoder keeps working on the next buffer in the meantime.
+ * We only wait for the background thread if it's still busy with the
+ * previous buffer by the time we fill the next one.  We don't start that
+ * thread until we've filled the first buffer, so small outputs are written
+ * directly by the destructor.
+ */
 class RansBlockWriter
 {
 private:
-  std::ofstream _stream;
-  std::vector< RansRange > _stack;
+  // Only used if we opened the file ourselves.
+  std::ofstream _file;
+  std::ostream &_stream;
+  const int _interleave;
+  const size_t _blockSize;
+  // Either a RansRange or a Rans64EncSymbol.  See flush().
+  struct Entry
+  {
+    // 0 for a RansRange.  Rans64EncSymbolInit() never sets this to 0.
+    uint64_t rcpFreq;
+    // RansRange::start() or Rans64EncSymbol::bias.
+    uint32_t startOrBias;
+    uint32_t freq;
+    // Not an aggregate.  g++ builds a braced temporary with two 8 byte
+    // stores, then copies it with one 16 byte load, which stalls.
+    Entry(uint64_t rcpFreq, uint32_t startOrBias, uint32_t freq) :
+      rcpFreq(rcpFreq), startOrBias(startOrBias), freq(freq) { }
+  };
+  std::vector< Entry > _stack;
+  std::vector< uint32_t > _arena;
+  std::vector< uint32_t > _pending;
+  std::vector< uint32_t > _writing;
+  std::thread _writerThread;
+  std::mutex _mutex;
+  std::condition_variable _condition;
+  // _writing contains data and the background thread owns it.
+  bool _busy;
+  // Tell the background thread to exit.
+  bool _done;
+  bool _closed;
+  std::atomic< bool > _failed;
+
+  int64_t _blockCount;
+  int64_t _symbolCount;
+  int64_t _bufferCount;
+  int64_t _allocationCount;
+  int64_t _stallMicroseconds;
+
   void flush(bool force = false);
+  void sendPending();
+  void writeToStream(std::vector< uint32_t > const &buffer);
+  void backgroundWriter();
+  void init();
 
 public:
-  RansBlockWriter(std::string const &fileName);
+  // How many rANS states to interleave in each block.  1 is the original
+  // format.  Any value from 1 to RANS_MAX_INTERLEAVE works and
+  // RansBlockReader will figure it out.  See RansHelper.h.
+  static const int DEFAULT_INTERLEAVE = 4;
+  // The maximum number of symbols in a block.  Bigger blocks save a little
+  // space.  Each block ends with 2 words for each rANS state.  Smaller
+  // blocks use less memory.  AUTO_BLOCK_SIZE means 10,000 symbols per state,
+  // which is random as anything.  The reader doesn't need to know.
+  static const size_t AUTO_BLOCK_SIZE = 0;
+  // We give data to the background thread in buffers about this big.
+  static const size_t OUTPUT_BUFFER_BYTES = 1<<20;
+  RansBlockWriter(std::string const &fileName,
+		  int interleave = DEFAULT_INTERLEAVE,
+		  size_t blockSize = AUTO_BLOCK_SIZE);
+  // Write to a stream that someone else owns, e.g. a std::ostringstream.
+  // Everything is written by the time the destructor or close() returns.
+  RansBlockWriter(std::ostream &stream, int interleave = DEFAULT_INTERLEAVE,
+		  size_t blockSize = AUTO_BLOCK_SIZE);
   ~RansBlockWriter();
-  bool error() const { return !_stream; }
+  RansBlockWriter(const RansBlockWriter&) =delete;
+  void operator=(const RansBlockWriter&) =delete;
+  bool error() const { return _failed; }
   std::string errorMessage() const;
   void write(RansRange const &toWrite);
+  // Faster, if you reuse the same symbols a lot.  See RansSymbolTable.
+  void write(Rans64EncSymbol const &toWrite);
+
+  // Send everything we've written so far to the stream, in complete
+  // blocks, and flush the stream.  A reader can decode all of it without
+  // waiting for anything more.  Each call can end a block early, and each
+  // block costs a header and the final rANS states, so don't call this
+  // after every symbol.
+  void flushToStream();
+
+  // Write the end of file marker and wait for everything to reach the
+  // stream.  The destructor will do this if you don't.  Don't write() after
+  // this.
+  void close();
+
+  // How many blocks we've written, how many times we had to allocate memory
+  // after the constructor, and how long we waited for the background thread.
+  void dumpStats(std::ostream &out) const;
 };
 
 
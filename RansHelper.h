@@ -86,6 +86,16 @@ public:
     return value;
   }
 
+  // Skip the conversion.  start and freq are already in the rANS domain,
+  // i.e. the denominator is SCALE_END.
+  static RansRange scaled(uint32_t start, uint32_t freq)
+  {
+    RansRange result;
+    result._start = start;
+    result._freq = freq;
+    return result;
+  }
+
   // An arbitrary safe state.
   void clear() { _start = 0; _freq = SCALE_END; }
   RansRange() { clear(); }
@@ -126,6 +136,18 @@ public:
     Rans64EncPut(r, pptr, _start, _freq, SCALE_BITS);
   }
 
+  // Do the expensive part of put() in advance.  See RansSymbolTable.
+  void initEncSymbol(Rans64EncSymbol *symbol) const
+  {
+    Rans64EncSymbolInit(symbol, _start, _freq, SCALE_BITS);
+  }
+  // The same as put() on the range that created symbol.
+  static void put(Rans64EncSymbol const &symbol,
+		  Rans64State* r, uint32_t** pptr)
+  {
+    Rans64EncPutSymbol(r, pptr, &symbol, SCALE_BITS);
+  }
+
   // First call get() to get the next number.  You should already have a list
   // of start positions for each symbol.  Find which symbol is associated with
   // this value.  (The symbol with the greatest start that is <= the
@@ -158,6 +180,49 @@ public:
   double idealCost() const { return pCostInBits(_freq / (double)SCALE_END); }
 };
 
+/* Rans64EncPut() divides by the frequency of the symbol.  If we encode the
+ * same ranges over and over, we can do that work once, up front, and save a
+ * Rans64EncSymbol for each range.  Rans64EncPutSymbol() uses a multiply
+ * instead of a divide and gives exactly the same output as Rans64EncPut().
+ *
+ * Symbol i in this table is the same as RansRange(the sum of the frequencies
+ * before i, frequencies[i], the sum of all frequencies).  Build a new table
+ * any time the frequencies change.  That's a good trade for a static model,
+ * like Count's table of bytes, or a model that only changes once per block.
+ * Use getEncSymbol() with RansBlockWriter::write() and getRange() with
+ * RansBlockReader::advance(). */
+class RansSymbolTable
+{
+private:
+  std::vector< RansRange > _ranges;
+  std::vector< Rans64EncSymbol > _encSymbols;
+public:
+  RansSymbolTable() { }
+  RansSymbolTable(std::vector< uint32_t > const &frequencies)
+  { load(frequencies); }
+  // A symbol with a frequency of 0 is allowed in the table, but you can't
+  // encode it.
+  void load(std::vector< uint32_t > const &frequencies)
+  {
+    uint32_t total = 0;
+    for (uint32_t frequency : frequencies)
+      total += frequency;
+    _ranges.clear();
+    _encSymbols.resize(frequencies.size());
+    uint32_t start = 0;
+    for (size_t i = 0; i < frequencies.size(); i++)
+    {
+      _ranges.emplace_back(start, frequencies[i], total);
+      _ranges.back().initEncSymbol(&_encSymbols[i]);
+      start += frequencies[i];
+    }
+  }
+  size_t size() const { return _ranges.size(); }
+  RansRange const &getRange(size_t symbol) const { return _ranges[symbol]; }
+  Rans64EncSymbol const &getEncSymbol(size_t symbol) const
+  { return _encSymbols[symbol]; }
+};
+
 /* Simple assumption:  We do not directly write any frequency info into the
  * compressed stream.  We start with the assumption that all symbols have
  * a frequency of 1.  Immediately after the compressor sends a symbol to the
@@ -167,24 +232,91 @@ public:
 class SymbolCounter
 {
 private:
+  /* _freq[i] is the frequency of symbol i.  Any symbol past the end of _freq
+   * has a frequency of 1.
+   *
+   * _tree is a Fenwick tree (a.k.a. binary indexed tree) built on top of
+   * _freq.  _tree[i] holds the sum of _freq[i - lowbit(i), i), where lowbit
+   * is the lowest bit that is set in i.  _tree[0] is unused.  That lets us
+   * find the start of a symbol, find the symbol at a given position, or
+   * increment a symbol in O(log n) time.  We used to add up all of the
+   * symbols each time, which is fine for a BoolCounter but not for a large
+   * alphabet.
+   *
+   * _total is the sum of everything in _freq. */
   std::vector< uint32_t > _freq;
+  std::vector< uint32_t > _tree;
+  uint32_t _total;
+  // 0 means no limit.  See the constructor.
+  uint32_t _maxTotal;
+  static size_t lowBit(size_t i) { return i & -i; }
+  void rebuild()
+  { // O(n).
+    const size_t size = _freq.size();
+    _tree.assign(size + 1, 0);
+    _total = 0;
+    for (size_t i = 1; i <= size; i++)
+    {
+      _tree[i] += _freq[i-1];
+      _total += _freq[i-1];
+      const size_t parent = i + lowBit(i);
+      if (parent <= size)
+	_tree[parent] += _tree[i];
+    }
+  }
   void ensureAtLeast(size_t newSize)
   {
     if (newSize > _freq.size())
-      _freq.resize(newSize, 1);
+    { // Grow geometrically so rebuild() is O(1) amortized.  The new entries
+      // are all 1, exactly like the entries we didn't store.
+      _freq.resize(std::max(newSize, _freq.size() * 2), 1);
+      rebuild();
+    }
   }
-  size_t getSymbol(uint32_t position, size_t symbolCount) const
+  // The sum of the frequencies of all symbols before symbol.
+  uint32_t start(size_t symbol) const
   {
-    uint32_t end = 0;
-    for (size_t i = 0; i < symbolCount; i++)
-    {
-      end += freq(i);
-      if (position < end)
-	return i;
+    const size_t size = _freq.size();
+    if (symbol >= size)
+      return _total + (symbol - size);
+    uint32_t result = 0;
+    for (size_t i = symbol; i; i -= lowBit(i))
+      result += _tree[i];
+    return result;
+  }
+  // Find the symbol at the given position.  *symbolStart is set to start()
+  // for that symbol.
+  size_t getSymbol(uint32_t position, uint32_t *symbolStart) const
+  {
+    const size_t size = _freq.size();
+    if (position >= _total)
+    { // Past the end of _freq, where every symbol has a frequency of 1.
+      *symbolStart = position;
+      return size + (position - _total);
     }
-    assert(false);
+    size_t found = 0;
+    uint32_t remaining = position;
+    size_t step = 1;
+    while (step * 2 <= size)
+      step *= 2;
+    for (; step; step /= 2)
+      if ((found + step <= size) && (_tree[found + step] <= remaining))
+      {
+	found += step;
+	remaining -= _tree[found];
+      }
+    *symbolStart = position - remaining;
+    return found;
   }
 public:
+  // If maxTotal is not 0, we automatically call reduceOld() any time the
+  // increments add up to more than maxTotal.  We don't count the 1 that
+  // every symbol starts with.  reduceOld() can't remove those, so a large
+  // alphabet would otherwise call reduceOld() after every increment.  The
+  // encoder and decoder call increment() the same way, so they will both
+  // call reduceOld() at the same time.
+  SymbolCounter(uint32_t maxTotal = 0) :
+    _tree(1, 0), _total(0), _maxTotal(maxTotal) { }
   uint32_t freq(size_t symbol) const
   {
     if (symbol >= _freq.size())
@@ -196,53 +328,35 @@ public:
   {
     ensureAtLeast(symbol + 1);
     _freq[symbol]++;
-    //if (_totals[0] > (RansRange::SCALE_END / 4))
-    //  reduceOld();
-    // TODO maybe return this or make someone else responsible.  I.e. maybe
-    // each block will always call increment some reasonable maximum number
-    // of times.  Someone else is already calling reduceOld() at the end of
-    // each block.
-    // NO -- The issue is not the max frequency of each item.  The issue
-    // is the total frequency that will we have to use as the denominator.
-    // TODO This class would be a great place to keep track of the total
-    // count in all of the entries, so we can automatically call reduceOld()
-    // when required.
-    // Issue:  This class was set up so you didn't have to state the maximum
-    // size in advance.  When we increment an item, we need to know the
-    // complete table size so we know the current denominator.  Right now we
-    // are fast and loose on the table size on purpose.  We probably need to
-    // set a max, or otherwise make sure that we do this consistently between
-    // the reader and the writer.
+    _total++;
+    for (size_t i = symbol + 1; i < _tree.size(); i += lowBit(i))
+      _tree[i]++;
+    // Every entry in _freq is at least 1.
+    if (_maxTotal && (_total - _freq.size() > _maxTotal))
+      reduceOld();
   }
+  // The denominator for getRange() and getSymbol().
+  uint32_t total(size_t symbolCount) const { return start(symbolCount); }
   RansRange getRange(size_t symbol, size_t symbolCount) const
   {
     assert(symbol < symbolCount);
-    uint32_t start = RansRange::SCALE_END;
-    uint32_t total = 0;
-    for (size_t i = 0; i < symbolCount; i++)
-    {
-      if (i == symbol)
-	start = total;
-      total += freq(i);
-    }
-    return RansRange(start, freq(symbol), total);
+    return RansRange(start(symbol), freq(symbol), total(symbolCount));
   }
   size_t getSymbol(Rans64State* r, uint32_t** pptr, size_t symbolCount) const
   {
-    uint32_t denominator = 0;
-    for (size_t i = 0; i < symbolCount; i++)
-      denominator += freq(i);
-    // seems like some duplication of effort between the two versions of
-    // getSymbol().  Maybe some room to make things faster.
+    const uint32_t denominator = total(symbolCount);
+    uint32_t symbolStart;
     const size_t symbol =
-      getSymbol(RansRange::get(denominator, r), symbolCount);
-    getRange(symbol, symbolCount).advance(r, pptr);
+      getSymbol(RansRange::get(denominator, r), &symbolStart);
+    assert(symbol < symbolCount);
+    RansRange(symbolStart, freq(symbol), denominator).advance(r, pptr);
     return symbol;
   }
   void reduceOld()
   {
     for (uint32_t &f : _freq)
       f = (f + 1) / 2;
+    rebuild();
     // It's tempting to remove some dead weight from the end of the list.
     // If there are extra 1's at the end, we could delete them and return the
     // memory.  Probably a small savings in memory, not worth the cost.
@@ -283,6 +397,125 @@ public:
   }
 };
 
+/* RansBlockWriter and RansBlockReader split the data into blocks.  Each block
+ * starts with a 32 bit word.  The low RANS_BLOCK_COUNT_BITS bits say how many
+ * symbols are in the block.  0 means end of file.  The next few bits say how
+ * many rANS states are interleaved in the block, minus 1.
+ *
+ * With more than one state, symbol 0 in the block uses state 0, symbol 1 uses
+ * state 1, etc., round robin.  All states share the same stream of words.
+ * Each put() or advance() still has a multiply or a divide on the critical
+ * path, but consecutive symbols no longer wait for each other, so the CPU can
+ * work on several at once.
+ *
+ * Older files always used 1 state and never had more than 10,000 symbols in
+ * a block, so those bits were always 0. */
+static const uint32_t RANS_BLOCK_COUNT_BITS = 24;
+static const uint32_t RANS_BLOCK_COUNT_MASK = (1u<<RANS_BLOCK_COUNT_BITS) - 1;
+static const int RANS_MAX_INTERLEAVE = 4;
+
+/* A faster alternative to BoolCounter, with the same interface.  The two do
+ * not give the same output, so a file format has to pick one or the other.
+ *
+ * BoolCounter counts how many times it's seen each value.  Each time we need
+ * a RansRange it adds up the counts, then divides to convert them to the rANS
+ * scale.  FastBoolCounter keeps the probability of false directly in the rANS
+ * scale, as a 31 bit fixed point number.  Each time we see a value we move
+ * that probability 1/32 of the way toward the value we saw, i.e. an
+ * exponential moving average.  That's a subtraction and a shift.  There's no
+ * memory allocation, and reading a value only takes one comparison.
+ *
+ * The rANS encoder still has to divide by the frequency of each symbol that
+ * it writes, unless it has a Rans64EncSymbol with a precomputed reciprocal.
+ * So we round the probability that we send to rANS to the middle of one of
+ * 2^LEVEL_BITS levels.  FastBoolCounterTable holds a Rans64EncSymbol for
+ * each level and each value, built once before main().  getEncSymbol()
+ * returns a reference into that table, so encoding with
+ * RansBlockWriter::write(Rans64EncSymbol) never divides and never copies.
+ * getRange() gives the same range, for the decoder, or for an encoder that
+ * doesn't care.
+ *
+ * The probability can never reach 0 or 1.  Once either side gets down to
+ * 2^ADAPTATION_SHIFT, the shift rounds the step down to 0.  After rounding,
+ * either side is at least 2^-(LEVEL_BITS+1).
+ *
+ * The moving average already forgets old data, so reduceOld() does nothing.
+ *
+ * See BoolCounterTest.C for a benchmark. */
+// A template only so the header can define encSymbols.  There is only one
+// copy, and reading it doesn't check a guard the way a function static
+// would.
+template < class Unused = void >
+struct FastBoolCounterTable
+{
+  static const std::vector< Rans64EncSymbol > encSymbols;
+};
+
+class FastBoolCounter
+{
+private:
+  static const int ADAPTATION_SHIFT = 5;
+  static const int LEVEL_BITS = 12;
+  static const int LEVEL_SHIFT = RansRange::SCALE_BITS - LEVEL_BITS;
+  // The probability of false * RansRange::SCALE_END.
+  uint32_t _falseFreq;
+  // What we send to rANS.  The middle of the level, so neither side is 0.
+  static uint32_t levelFreq(uint32_t level)
+  { return (level << LEVEL_SHIFT) | (1u << (LEVEL_SHIFT - 1)); }
+  uint32_t codedFalseFreq() const
+  { return levelFreq(_falseFreq >> LEVEL_SHIFT); }
+  // Indexed by level, for false, then by level + 2^LEVEL_BITS, for true.
+  // The same ranges as getRange().
+  static std::vector< Rans64EncSymbol > makeEncSymbols()
+  {
+    std::vector< Rans64EncSymbol > result(2 << LEVEL_BITS);
+    for (uint32_t level = 0; level < (1u << LEVEL_BITS); level++)
+    {
+      const uint32_t falseFreq = levelFreq(level);
+      RansRange::scaled(0, falseFreq).initEncSymbol(&result[level]);
+      RansRange::scaled(falseFreq, RansRange::SCALE_END - falseFreq)
+	.initEncSymbol(&result[level + (1 << LEVEL_BITS)]);
+    }
+    return result;
+  }
+  template < class > friend struct FastBoolCounterTable;
+public:
+  FastBoolCounter() : _falseFreq(RansRange::SCALE_END / 2) { }
+  void increment(bool value)
+  {
+    if (value)
+      _falseFreq -= _falseFreq >> ADAPTATION_SHIFT;
+    else
+      _falseFreq += (RansRange::SCALE_END - _falseFreq) >> ADAPTATION_SHIFT;
+  }
+  RansRange getRange(bool value) const
+  {
+    const uint32_t falseFreq = codedFalseFreq();
+    if (value)
+      return RansRange::scaled(falseFreq, RansRange::SCALE_END - falseFreq);
+    else
+      return RansRange::scaled(0, falseFreq);
+  }
+  // The same as getRange(value).initEncSymbol(), without the division.
+  Rans64EncSymbol const &getEncSymbol(bool value) const
+  {
+    return FastBoolCounterTable<>::encSymbols
+      [((uint32_t)value << LEVEL_BITS) | (_falseFreq >> LEVEL_SHIFT)];
+  }
+  bool readValue(Rans64State* r, uint32_t** pptr) const
+  {
+    const bool value =
+      Rans64DecGet(r, RansRange::SCALE_BITS) >= codedFalseFreq();
+    getRange(value).advance(r, pptr);
+    return value;
+  }
+  void reduceOld() { }
+};
+
+template < class Unused >
+const std::vector< Rans64EncSymbol > FastBoolCounterTable< Unused >::encSymbols =
+  FastBoolCounter::makeEncSymbols();
+
 inline bool isIntelByteOrder()
 {
   const uint64_t number = 0x0102030405060708lu;
@@ -14,7 +14,15 @@ private:
   uint32_t *_next;
   const uint32_t *_end;
   int32_t _remainingInBlock;
-  Rans64State _ransState;
+  // See RANS_BLOCK_COUNT_BITS in RansHelper.h.
+  Rans64State _ransStates[RANS_MAX_INTERLEAVE];
+  int _interleave;
+  // Which state will decode the next symbol.
+  int _current;
+  // Someone used _current since the last call to eof().  getNext() can't
+  // move on to the next state itself because the caller might or might not
+  // have already called getRansState().
+  bool _used;
   
 public:
   RansBlockReader(char const *fileName);
@@ -46,8 +54,8 @@ public:
   // Then do a get followed by an advance.  3 steps every time.
   //
   // Super duper ugly.
-  uint32_t **getNext() { _remainingInBlock--; return &_next; }
-  Rans64State *getRansState() { return &_ransState; }
+  uint32_t **getNext() { _remainingInBlock--; _used = true; return &_next; }
+  Rans64State *getRansState() { return &_ransStates[_current]; }
   
   void dumpStats(std::ostream &out);
 
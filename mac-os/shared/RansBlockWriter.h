@@ -10,15 +10,36 @@ class RansBlockWriter
 {
 private:
   std::ofstream _stream;
-  std::vector< RansRange > _stack;
+  const int _interleave;
+  // Either a RansRange or a Rans64EncSymbol.  See flush().
+  struct Entry
+  {
+    // 0 for a RansRange.  Rans64EncSymbolInit() never sets this to 0.
+    uint64_t rcpFreq;
+    // RansRange::start() or Rans64EncSymbol::bias.
+    uint32_t startOrBias;
+    uint32_t freq;
+    // Not an aggregate.  g++ builds a braced temporary with two 8 byte
+    // stores, then copies it with one 16 byte load, which stalls.
+    Entry(uint64_t rcpFreq, uint32_t startOrBias, uint32_t freq) :
+      rcpFreq(rcpFreq), startOrBias(startOrBias), freq(freq) { }
+  };
+  std::vector< Entry > _stack;
   void flush(bool force = false);
 
 public:
-  RansBlockWriter(std::string const &fileName);
+  // How many rANS states to interleave in each block.  1 is the original
+  // format.  Any value from 1 to RANS_MAX_INTERLEAVE works and
+  // RansBlockReader will figure it out.  See RansHelper.h.
+  static const int DEFAULT_INTERLEAVE = 4;
+  RansBlockWriter(std::string const &fileName,
+		  int interleave = DEFAULT_INTERLEAVE);
   ~RansBlockWriter();
   bool error() const { return !_stream; }
   std::string errorMessage() const;
   void write(RansRange const &toWrite);
+  // Faster, if you reuse the same symbols a lot.  See RansSymbolTable.
+  void write(Rans64EncSymbol const &toWrite);
 
   /**
    * This covers the simple case where there are count possible values,